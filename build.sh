@@ -26,8 +26,8 @@ meson configure --default-library static
 ninja install
 cd ../../
 
-# Build static squashfuse
-apk add zstd-dev zstd-static zlib-dev zlib-static # fuse-dev fuse-static fuse3-static fuse3-dev
+# Build static squashfuse; libdeflate is only used by the runtime itself, for gzip compressed images
+apk add zstd-dev zstd-static zlib-dev zlib-static lz4-dev lz4-static xz-dev xz-static libdeflate-dev libdeflate-static # fuse-dev fuse-static fuse3-static fuse3-dev
 wget -c -q "https://github.com/vasi/squashfuse/archive/e51978c.tar.gz"
 tar xf e51978c.tar.gz
 cd squashfuse-*/
@@ -84,11 +84,99 @@ wget -O squashfs-tools.tar.gz https://github.com/plougher/squashfs-tools/archive
 tar xf squashfs-tools.tar.gz
 cd squashfs-tools-*/squashfs-tools
 sed -i -e 's|#ZSTD_SUPPORT = 1|ZSTD_SUPPORT = 1|g' Makefile
+sed -i -e 's|#LZ4_SUPPORT = 1|LZ4_SUPPORT = 1|g' -e 's|#XZ_SUPPORT = 1|XZ_SUPPORT = 1|g' Makefile
 make -j$(nproc) LDFLAGS=-static
 file mksquashfs unsquashfs
 strip mksquashfs unsquashfs
 cd -
 
+# Build the latency-optimized runtime-fuse3-fast: squashfuse, zstd, zlib and libdeflate are rebuilt with -O2 and LTO
+# into their own prefix, and everything is built twice, first instrumented to record a profile of the training
+# workload in src/runtime/train.sh, then optimized with it. Each library is rebuilt in the same directory both times,
+# as GCC names the profile of an object after its path.
+FAST_PREFIX=/usr/local/fast
+PROFILE_DIR=$(pwd)/src/runtime/profile
+wget -c -q "https://github.com/facebook/zstd/releases/download/v1.5.6/zstd-1.5.6.tar.gz"
+tar xf zstd-1.5.6.tar.gz
+wget -c -q "https://github.com/madler/zlib/releases/download/v1.3.1/zlib-1.3.1.tar.gz"
+tar xf zlib-1.3.1.tar.gz
+wget -c -q -O libdeflate-1.22.tar.gz "https://github.com/ebiggers/libdeflate/archive/refs/tags/v1.22.tar.gz"
+tar xf libdeflate-1.22.tar.gz
+
+build_fast_libs() {
+	FAST_CFLAGS="-O2 -flto=auto -ffat-lto-objects -ffunction-sections -fdata-sections $1"
+
+	# zstd names its object directory after a hash of the flags unless BUILD_DIR is given
+	cd zstd-1.5.6/
+	make -C lib clean BUILD_DIR=obj/fast
+	CFLAGS="$FAST_CFLAGS" make -C lib -j$(nproc) libzstd.a BUILD_DIR=obj/fast
+	make -C lib install-static install-includes BUILD_DIR=obj/fast PREFIX=$FAST_PREFIX
+	cd -
+
+	cd zlib-1.3.1/
+	make distclean || true
+	CFLAGS="$FAST_CFLAGS" ./configure --static --prefix=$FAST_PREFIX
+	make -j$(nproc) libz.a
+	make install
+	cd -
+
+	# libdeflate only ships a CMake build, but its library is just the sources in lib/
+	cd libdeflate-1.22/
+	rm -f libdeflate.a lib/*.o lib/*/*.o
+	for source in lib/*.c lib/*/*.c; do
+		gcc $FAST_CFLAGS -I. -c $source -o ${source%.c}.o
+	done
+	ar rcs libdeflate.a lib/*.o lib/*/*.o
+	install -D -m 644 libdeflate.a $FAST_PREFIX/lib/libdeflate.a
+	install -D -m 644 libdeflate.h $FAST_PREFIX/include/libdeflate.h
+	cd -
+
+	cd squashfuse-*/
+	make distclean || true
+	./configure CFLAGS="-no-pie $FAST_CFLAGS" LDFLAGS="-static $FAST_CFLAGS" --prefix=$FAST_PREFIX --with-zstd=$FAST_PREFIX --with-zlib=$FAST_PREFIX
+	make -j$(nproc)
+	make install
+	mkdir -p $FAST_PREFIX/include/squashfuse
+	/usr/bin/install -c -m 644 *.h $FAST_PREFIX/include/squashfuse # ll.h
+	cd -
+}
+
+# One corpus per compression, built with the regular runtime, serves both the training and the comparison below. The
+# runtimes run on it through TARGET_APPIMAGE. Huge files are kept at 64 MiB each, as all of this runs under
+# qemu-user on the other architectures.
+MKSQUASHFS=$(echo $(pwd)/squashfs-tools-*/squashfs-tools/mksquashfs)
+for compression in zstd gzip; do
+	COMPRESSION=$compression HUGE_FILE_MB=64 RUNTIME=$(pwd)/src/runtime/runtime-fuse3 MKSQUASHFS=$MKSQUASHFS \
+		./make_corpus.sh corpus-$compression tiny-files huge-files links incompressible
+done
+
+build_fast_libs "-fprofile-generate -fprofile-update=atomic -fprofile-dir=$PROFILE_DIR"
+cd src/runtime
+make runtime-fuse3-fast-instrumented -j$(nproc)
+./train.sh ./runtime-fuse3-fast-instrumented ../../corpus-zstd ../../corpus-gzip
+cd -
+build_fast_libs "-fprofile-use -fprofile-partial-training -Wno-missing-profile -fprofile-dir=$PROFILE_DIR"
+cd src/runtime
+make runtime-fuse3-fast -j$(nproc)
+strip runtime-fuse3-fast
+ls -lh runtime-fuse3 runtime-fuse3-fast
+echo -ne 'AI\x02' | dd of=runtime-fuse3-fast bs=1 count=3 seek=8 conv=notrunc # magic bytes, always do AFTER strip
+cd -
+
+# Compare both runtimes, published next to the binaries: decompression and SHA-256 hashing throughput on the corpus
+# (--appimage-decode-benchmark), then mounting and reading through FUSE with bench.sh, where FUSE is usable
+mkdir -p out
+for app in corpus-zstd/huge-files.AppImage corpus-zstd/incompressible.AppImage corpus-gzip/huge-files.AppImage corpus-gzip/incompressible.AppImage; do
+	for runtime in runtime-fuse3 runtime-fuse3-fast; do
+		echo "{\"runtime\":\"$runtime\",\"size\":$(stat -c %s src/runtime/$runtime),\"image\":\"$app\",\"decode\":$(TARGET_APPIMAGE=$app src/runtime/$runtime --appimage-decode-benchmark)}"
+	done
+done | tee out/runtime-fuse3-fast-comparison-$ARCHITECTURE.jsonl
+for runtime in runtime-fuse3 runtime-fuse3-fast; do
+	BENCH_RUNS=3 BENCH_COMPRESSIONS=zstd BENCH_BLOCK_SIZES=128K BENCH_FILE_MB=64 src/runtime/bench.sh src/runtime/$runtime "$MKSQUASHFS" \
+		| grep -e mount_to_apprun -e first_read -e sequential_read | sed -e "s/^{/{\"runtime\":\"$runtime\",/"
+done | tee -a out/runtime-fuse3-fast-comparison-$ARCHITECTURE.jsonl
+rm -rf corpus-zstd corpus-gzip
+
 # Build static desktop-file-utils
 # apk add glib-static glib-dev
 wget -c https://gitlab.freedesktop.org/xdg/desktop-file-utils/-/archive/56d220dd679c7c3a8f995a41a27a7d6f3df49dea/desktop-file-utils-56d220dd679c7c3a8f995a41a27a7d6f3df49dea.tar.gz
@@ -160,6 +248,7 @@ cd -
 
 mkdir -p out
 cp src/runtime/runtime-fuse3 out/runtime-fuse3-$ARCHITECTURE
+cp src/runtime/runtime-fuse3-fast out/runtime-fuse3-fast-$ARCHITECTURE
 cp patchelf-*/patchelf out/patchelf-$ARCHITECTURE
 cp zsync-*/zsync out/zsync-$ARCHITECTURE
 cp zsync-*/zsyncmake out/zsyncmake-$ARCHITECTURE
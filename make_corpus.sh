@@ -0,0 +1,218 @@
+#!/bin/sh
+
+# Generates a corpus of synthetic AppImages for performance and regression testing. The payloads are deterministic and
+# the images are built with fixed timestamps and ownership, so the same runtime and mksquashfs produce byte-identical
+# AppImages on every machine (compare with the SHA256SUMS file written next to them).
+#
+# Usage: make_corpus.sh [<output directory>] [<profile>...]
+#
+# Profiles:
+#   tiny-files      many files of up to 1 KiB in a few hundred directories
+#   huge-files      a few large, compressible files
+#   deep-tree       directories nested 200 levels deep
+#   wide-dir        a single directory with a very large number of entries
+#   links           many hardlinks and symlinks, including symlink chains
+#   sparse          large files that are mostly holes
+#   incompressible  pseudo-random data that no compressor can shrink
+#
+# Environment:
+#   RUNTIME         runtime to prepend (src/runtime/runtime-fuse3)
+#   MKSQUASHFS      mksquashfs to use (the one built by build.sh, else from $PATH)
+#   COMPRESSION     mksquashfs compressor (zstd)
+#   BLOCK_SIZE      mksquashfs block size (128K)
+#   CORPUS_SCALE    multiplies the file counts and sizes of all profiles (1)
+#   HUGE_FILE_MB    size of each of the files of huge-files in MiB, before scaling (256)
+
+set -e
+
+HERE=$(dirname "$(realpath "$0")")
+OUT=$(realpath -m "${1:-corpus}")
+[ $# -gt 0 ] && shift
+PROFILES=${*:-tiny-files huge-files deep-tree wide-dir links sparse incompressible}
+
+RUNTIME=${RUNTIME:-$HERE/src/runtime/runtime-fuse3}
+if [ -z "$MKSQUASHFS" ]; then
+	MKSQUASHFS=$(ls "$HERE"/squashfs-tools-*/squashfs-tools/mksquashfs 2>/dev/null | head -n 1)
+	MKSQUASHFS=${MKSQUASHFS:-mksquashfs}
+fi
+COMPRESSION=${COMPRESSION:-zstd}
+BLOCK_SIZE=${BLOCK_SIZE:-128K}
+SCALE=${CORPUS_SCALE:-1}
+HUGE_FILE_MB=${HUGE_FILE_MB:-256}
+
+if [ ! -x "$RUNTIME" ]; then
+	echo "Runtime $RUNTIME not found, run build.sh first or set RUNTIME"
+	exit 1
+fi
+
+export LC_ALL=C
+umask 022
+
+# Writes $2 bytes of pseudo-random data for seed $1, using the Park-Miller generator so that every awk produces the
+# same bytes. NUL is never written, as not every awk can print it.
+random_bytes() {
+	awk -v seed="$1" -v n="$2" 'BEGIN {
+		x = seed % 2147483646 + 1
+		for (i = 0; i < n; i++) {
+			x = x * 16807 % 2147483647
+			printf "%c", x % 255 + 1
+		}
+	}'
+}
+
+# Writes $2 MiB of incompressible data for seed $1. awk is slow, so a 2 MiB random block is repeated: squashfs
+# compresses each block of at most 1 MiB on its own and never sees the repetition.
+random_mib() {
+	random_bytes "$1" 2097152 > "$WORK/random"
+	i=0
+	while [ $i -lt "$2" ]; do
+		if [ $((i % 2)) -eq 0 ]; then
+			head -c 1048576 "$WORK/random"
+		else
+			tail -c 1048576 "$WORK/random"
+		fi
+		i=$((i + 1))
+	done
+	rm -f "$WORK/random"
+}
+
+# Writes $2 MiB of text that compresses about as well as typical binaries and assets, starting at line $1
+text_mib() {
+	seq "$1" 999999999 | head -c $(($2 * 1048576))
+}
+
+# Every AppImage gets what desktop integration needs, and an AppRun that exits right away
+make_appdir() {
+	dir=$1
+	name=$2
+	mkdir -p "$dir/usr/share/metainfo"
+	printf '#!/bin/sh\nexit 0\n' > "$dir/AppRun"
+	chmod 755 "$dir/AppRun"
+	printf '[Desktop Entry]\nType=Application\nName=%s\nExec=AppRun\nIcon=%s\nCategories=Utility;\n' \
+		"$name" "$name" > "$dir/$name.desktop"
+	random_bytes 1 4096 > "$dir/$name.png"
+	ln -s "$name.png" "$dir/.DirIcon"
+	printf '<?xml version="1.0"?>\n<component type="desktop-application"><id>%s</id></component>\n' \
+		"$name" > "$dir/usr/share/metainfo/$name.appdata.xml"
+}
+
+profile_tiny_files() {
+	d=0
+	while [ $d -lt $((200 * SCALE)) ]; do
+		mkdir -p "$1/usr/lib/tiny/$d"
+		f=0
+		while [ $f -lt 100 ]; do
+			seq $((d * 100 + f)) $((d * 100 + f + (d * 7 + f * 13) % 150)) > "$1/usr/lib/tiny/$d/$f.txt"
+			f=$((f + 1))
+		done
+		d=$((d + 1))
+	done
+}
+
+profile_huge_files() {
+	mkdir -p "$1/usr/share/huge"
+	i=0
+	while [ $i -lt 3 ]; do
+		text_mib $((i * 100000000 + 1)) $((HUGE_FILE_MB * SCALE)) > "$1/usr/share/huge/$i.bin"
+		i=$((i + 1))
+	done
+}
+
+# The depth is fixed, as 200 levels already make paths of about 2 KiB and PATH_MAX is 4 KiB; CORPUS_SCALE adds files
+# to each level instead
+profile_deep_tree() {
+	dir="$1/usr/share/deep"
+	depth=0
+	while [ $depth -lt 200 ]; do
+		dir="$dir/level$depth"
+		mkdir -p "$dir"
+		seq $depth $((depth + 50)) > "$dir/file.txt"
+		f=1
+		while [ $f -lt "$SCALE" ]; do
+			seq $((depth + f)) $((depth + f + 50)) > "$dir/file$f.txt"
+			f=$((f + 1))
+		done
+		depth=$((depth + 1))
+	done
+}
+
+profile_wide_dir() {
+	mkdir -p "$1/usr/share/wide"
+	cd "$1/usr/share/wide"
+	seq 1 $((50000 * SCALE)) | awk '{ printf "entry-%08d.txt\n", $1 }' | xargs touch
+	cd - > /dev/null
+}
+
+profile_links() {
+	mkdir -p "$1/usr/lib/links/files" "$1/usr/lib/links/hard" "$1/usr/lib/links/soft"
+	i=0
+	while [ $i -lt $((1000 * SCALE)) ]; do
+		seq $i $((i + 200)) > "$1/usr/lib/links/files/$i.txt"
+		h=0
+		while [ $h -lt 10 ]; do
+			ln "$1/usr/lib/links/files/$i.txt" "$1/usr/lib/links/hard/$i-$h.txt"
+			h=$((h + 1))
+		done
+		# a chain of three symlinks, the last one relative to another directory
+		ln -s "../files/$i.txt" "$1/usr/lib/links/soft/$i-0"
+		ln -s "$i-0" "$1/usr/lib/links/soft/$i-1"
+		ln -s "$i-1" "$1/usr/lib/links/soft/$i-2"
+		i=$((i + 1))
+	done
+}
+
+profile_sparse() {
+	mkdir -p "$1/usr/share/sparse"
+	i=0
+	while [ $i -lt 4 ]; do
+		f="$1/usr/share/sparse/$i.img"
+		truncate -s $((1024 * SCALE))M "$f"
+		# a little data every 64 MiB, the rest is holes that mksquashfs stores as sparse blocks
+		off=0
+		while [ $off -lt $((1024 * SCALE)) ]; do
+			text_mib $((off + i)) 1 | dd of="$f" bs=1M seek=$off conv=notrunc status=none
+			off=$((off + 64))
+		done
+		i=$((i + 1))
+	done
+}
+
+profile_incompressible() {
+	mkdir -p "$1/usr/share/random"
+	i=0
+	while [ $i -lt 4 ]; do
+		random_mib $((i + 1)) $((64 * SCALE)) > "$1/usr/share/random/$i.bin"
+		i=$((i + 1))
+	done
+}
+
+mkdir -p "$OUT"
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/appimage-corpus-XXXXXX")
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+for profile in $PROFILES; do
+	echo "Generating $profile"
+	payload="$WORK/$profile"
+	make_appdir "$payload" "$profile"
+	case $profile in
+		tiny-files) profile_tiny_files "$payload" ;;
+		huge-files) profile_huge_files "$payload" ;;
+		deep-tree) profile_deep_tree "$payload" ;;
+		wide-dir) profile_wide_dir "$payload" ;;
+		links) profile_links "$payload" ;;
+		sparse) profile_sparse "$payload" ;;
+		incompressible) profile_incompressible "$payload" ;;
+		*) echo "Unknown profile $profile"; exit 1 ;;
+	esac
+
+	# fixed times and ownership make the image depend on the payload only
+	"$MKSQUASHFS" "$payload" "$WORK/$profile.squashfs" -noappend -all-root -all-time 0 -mkfs-time 0 \
+		-no-progress -quiet -comp "$COMPRESSION" -b "$BLOCK_SIZE" > /dev/null
+	cat "$RUNTIME" "$WORK/$profile.squashfs" > "$OUT/$profile.AppImage"
+	chmod 755 "$OUT/$profile.AppImage"
+	rm -rf "$payload" "$WORK/$profile.squashfs"
+done
+
+cd "$OUT"
+sha256sum *.AppImage > SHA256SUMS
+cat SHA256SUMS
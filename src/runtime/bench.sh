@@ -0,0 +1,230 @@
+#!/bin/sh
+
+# Measures the runtime on generated test AppImages and prints one JSON object per line, sorted so that the output of
+# two commits can be compared with diff:
+#
+#   {"case":"zstd-128K","metric":"mount_to_apprun_ms","value":12.345}
+#
+# Usage: bench.sh [<runtime>] [<mksquashfs>]
+#
+# Every value is the median of BENCH_RUNS runs. The image stays in the page cache between runs, so "cold" only refers
+# to the state of the runtime: a fresh mount or a fresh extraction directory. Runs that fail, e.g. because FUSE is not
+# usable here, are left out, and a measurement without any successful run is recorded as null.
+#
+# Environment:
+#   BENCH_RUNS          runs per measurement (5)
+#   BENCH_COMPRESSIONS  mksquashfs compressors to test ("zstd gzip")
+#   BENCH_BLOCK_SIZES   mksquashfs block sizes to test ("64K 128K 1M")
+#   BENCH_FILE_MB       size of the large file used for read throughput (128)
+
+set -eu
+
+RUNTIME=$(realpath "${1:-./runtime-fuse3}")
+MKSQUASHFS=${2:-${MKSQUASHFS:-mksquashfs}}
+RUNS=${BENCH_RUNS:-5}
+COMPRESSIONS=${BENCH_COMPRESSIONS:-zstd gzip}
+BLOCK_SIZES=${BENCH_BLOCK_SIZES:-64K 128K 1M}
+FILE_MB=${BENCH_FILE_MB:-128}
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/appimage-bench-XXXXXX")
+MOUNT_PID=
+cleanup() {
+	[ -n "$MOUNT_PID" ] && kill "$MOUNT_PID" 2>/dev/null && wait "$MOUNT_PID" 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+now_ns() {
+	date +%s%N
+}
+
+# Prints the difference of two nanosecond timestamps in milliseconds
+ms() {
+	awk -v a="$1" -v b="$2" 'BEGIN { printf "%.3f", (b - a) / 1e6 }'
+}
+
+median() {
+	sort -n | awk '{ v[NR] = $1 } END { print (NR > 0 ? v[int((NR + 1) / 2)] : "null") }'
+}
+
+# Prints the time from $1 until AppRun wrote its start time to the stamp file, nothing if AppRun did not run
+ms_to_stamp() {
+	[ -s "$WORK/stamp" ] || return 0
+	ms "$1" "$(cat "$WORK/stamp")"
+	echo
+}
+
+result() {
+	printf '{"case":"%s","metric":"%s","value":%s}\n' "$1" "$2" "$3" >> "$WORK/results"
+}
+
+# Runs a command RUNS times and records the median wall time
+measure() {
+	case_name=$1
+	metric=$2
+	shift 2
+	i=0
+	while [ $i -lt "$RUNS" ]; do
+		start=$(now_ns)
+		"$@" > /dev/null 2>&1 || true
+		ms "$start" "$(now_ns)"
+		echo
+		i=$((i + 1))
+	done | median > "$WORK/median"
+	result "$case_name" "$metric" "$(cat "$WORK/median")"
+}
+
+make_payload() {
+	dir=$1
+	mkdir -p "$dir/usr/bin" "$dir/usr/lib/small" "$dir/usr/share/data" "$dir/usr/share/metainfo"
+
+	# AppRun records when it was started, which marks the end of the runtime's work
+	cat > "$dir/AppRun" <<'EOF'
+#!/bin/sh
+[ -n "${BENCH_STAMP:-}" ] && date +%s%N > "$BENCH_STAMP"
+exit 0
+EOF
+	chmod +x "$dir/AppRun"
+	printf '[Desktop Entry]\nType=Application\nName=Bench\nExec=AppRun\nIcon=bench\nCategories=Utility;\n' \
+		> "$dir/bench.desktop"
+	head -c 16384 /dev/urandom > "$dir/bench.png"
+	ln -s bench.png "$dir/.DirIcon"
+	printf '<?xml version="1.0"?>\n<component type="desktop-application"><id>bench</id></component>\n' \
+		> "$dir/usr/share/metainfo/bench.appdata.xml"
+
+	# half text, half random data, roughly what binaries and assets compress like
+	half=$((FILE_MB * 512 * 1024))
+	{ seq 1 100000000 | head -c $half; head -c $half /dev/urandom; } > "$dir/usr/share/data/large.bin"
+
+	i=0
+	while [ $i -lt 2000 ]; do
+		seq $i $((i + 100)) > "$dir/usr/lib/small/$i.txt"
+		i=$((i + 1))
+	done
+}
+
+make_appimage() {
+	out=$1
+	compression=$2
+	block_size=$3
+	"$MKSQUASHFS" "$WORK/payload" "$WORK/image.squashfs" -noappend -root-owned -no-progress -quiet \
+		-comp "$compression" -b "$block_size" > /dev/null
+	cat "$RUNTIME" "$WORK/image.squashfs" > "$out"
+	chmod +x "$out"
+	rm -f "$WORK/image.squashfs"
+}
+
+# Mounts the AppImage in the background and sets MOUNT_POINT
+mount_appimage() {
+	"$1" --appimage-mount > "$WORK/mountpoint" &
+	MOUNT_PID=$!
+	while [ ! -s "$WORK/mountpoint" ]; do
+		kill -0 "$MOUNT_PID" 2>/dev/null || return 1
+		sleep 0.01
+	done
+	MOUNT_POINT=$(head -n 1 "$WORK/mountpoint")
+}
+
+unmount_appimage() {
+	kill "$MOUNT_PID"
+	wait "$MOUNT_PID" 2>/dev/null || true
+	MOUNT_PID=
+	rm -f "$WORK/mountpoint"
+}
+
+# Median time from starting the AppImage until AppRun runs
+time_to_apprun() {
+	case_name=$1
+	metric=$2
+	shift 2
+	i=0
+	while [ $i -lt "$RUNS" ]; do
+		rm -f "$WORK/stamp"
+		start=$(now_ns)
+		BENCH_STAMP="$WORK/stamp" "$@" > /dev/null 2>&1 || true
+		ms_to_stamp "$start"
+		i=$((i + 1))
+	done | median > "$WORK/median"
+	result "$case_name" "$metric" "$(cat "$WORK/median")"
+}
+
+bench_appimage() {
+	case_name=$1
+	app=$2
+	large=usr/share/data/large.bin
+	payload_kb=$(du -sk "$WORK/payload" | cut -f1)
+
+	time_to_apprun "$case_name" mount_to_apprun_ms "$app"
+
+	# the first read pays for opening the file and decoding its first block, the rest is streaming
+	first=
+	sequential=
+	i=0
+	while [ $i -lt "$RUNS" ]; do
+		if ! mount_appimage "$app"; then
+			MOUNT_PID=
+			i=$((i + 1))
+			continue
+		fi
+		start=$(now_ns)
+		head -c 4096 "$MOUNT_POINT/$large" > /dev/null
+		first="$first $(ms "$start" "$(now_ns)")"
+		start=$(now_ns)
+		cat "$MOUNT_POINT/$large" > /dev/null
+		sequential="$sequential $(awk -v ms="$(ms "$start" "$(now_ns)")" -v mb="$FILE_MB" \
+			'BEGIN { printf "%.1f", mb * 1048.576 / ms }')"
+		unmount_appimage
+		i=$((i + 1))
+	done
+	result "$case_name" first_read_ms "$(echo "$first" | tr ' ' '\n' | sed '/^$/d' | median)"
+	result "$case_name" sequential_read_mb_per_s "$(echo "$sequential" | tr ' ' '\n' | sed '/^$/d' | median)"
+
+	mkdir -p "$WORK/extract"
+	i=0
+	while [ $i -lt "$RUNS" ]; do
+		rm -rf "$WORK/extract/squashfs-root"
+		start=$(now_ns)
+		(cd "$WORK/extract" && "$app" --appimage-extract > /dev/null)
+		awk -v ms="$(ms "$start" "$(now_ns)")" -v kb="$payload_kb" 'BEGIN { printf "%.1f\n", kb * 1.024 / ms }'
+		i=$((i + 1))
+	done | median > "$WORK/median"
+	result "$case_name" extract_mb_per_s "$(cat "$WORK/median")"
+	rm -rf "$WORK/extract"
+
+	i=0
+	while [ $i -lt "$RUNS" ]; do
+		rm -rf "$WORK/cold"
+		mkdir -p "$WORK/cold"
+		rm -f "$WORK/stamp"
+		start=$(now_ns)
+		TMPDIR="$WORK/cold" BENCH_STAMP="$WORK/stamp" "$app" --appimage-extract-and-run > /dev/null 2>&1 || true
+		ms_to_stamp "$start"
+		i=$((i + 1))
+	done | median > "$WORK/median"
+	result "$case_name" extract_and_run_cold_ms "$(cat "$WORK/median")"
+	rm -rf "$WORK/cold"
+
+	# with NO_CLEANUP, later runs find the files of the first one in place
+	mkdir -p "$WORK/warm"
+	(
+		export TMPDIR="$WORK/warm" NO_CLEANUP=1
+		"$app" --appimage-extract-and-run > /dev/null 2>&1 || true
+		time_to_apprun "$case_name" extract_and_run_warm_ms "$app" --appimage-extract-and-run
+	)
+	rm -rf "$WORK/warm"
+
+	for query in offset info updateinfo signature; do
+		measure "$case_name" "query_${query}_ms" "$app" "--appimage-$query"
+	done
+}
+
+make_payload "$WORK/payload"
+for compression in $COMPRESSIONS; do
+	for block_size in $BLOCK_SIZES; do
+		make_appimage "$WORK/bench.AppImage" "$compression" "$block_size"
+		bench_appimage "$compression-$block_size" "$WORK/bench.AppImage"
+		rm -f "$WORK/bench.AppImage"
+	done
+done
+
+sort "$WORK/results"
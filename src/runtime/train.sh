@@ -0,0 +1,56 @@
+#!/bin/sh
+
+# The PGO training workload for runtime-fuse3-fast. Runs the given instrumented runtime on every AppImage in the given
+# corpus directories (see make_corpus.sh) through TARGET_APPIMAGE: it extracts, checks, hashes and queries them and,
+# where FUSE can be used, mounts them and reads every file. Each run of the runtime adds to the profiles in the
+# directory the runtime was built with.
+#
+# Usage: train.sh <instrumented runtime> <corpus directory>...
+
+set -e
+
+RUNTIME=$(realpath "$1")
+shift
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/appimage-train-XXXXXX")
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+can_mount() {
+	[ -c /dev/fuse ] && [ -r /dev/fuse ] && [ -w /dev/fuse ] && command -v fusermount3 > /dev/null
+}
+
+for corpus in "$@"; do
+	for app in "$corpus"/*.AppImage; do
+		app=$(realpath "$app")
+		echo "Training on $app"
+		export TARGET_APPIMAGE="$app"
+		for option in offset info updateinfo signature verify decode-benchmark; do
+			"$RUNTIME" --appimage-$option > /dev/null
+		done
+		"$RUNTIME" --appimage-extract-integration - > /dev/null
+		(cd "$WORK" && "$RUNTIME" --appimage-extract > /dev/null && rm -rf squashfs-root)
+		# hashes the whole file to name the extraction directory, then extracts and runs AppRun
+		TMPDIR="$WORK" "$RUNTIME" --appimage-extract-and-run
+
+		if can_mount; then
+			"$RUNTIME" --appimage-mount > "$WORK/mountpoint" &
+			pid=$!
+			while [ ! -s "$WORK/mountpoint" ] && kill -0 $pid 2>/dev/null; do
+				sleep 0.01
+			done
+			mnt=$(head -n 1 "$WORK/mountpoint")
+			find "$mnt" -type f -exec cat {} + > /dev/null
+			find "$mnt" -type l -exec readlink {} + > /dev/null
+			ls -lR "$mnt" > /dev/null
+			# SIGTERM ends the FUSE session and lets the runtime exit, which writes its profile
+			kill $pid
+			wait $pid || true
+			rm -f "$WORK/mountpoint"
+		fi
+		unset TARGET_APPIMAGE
+	done
+done
+
+if ! can_mount; then
+	echo "FUSE is not usable here, trained without mount and read"
+fi